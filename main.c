@@ -4,6 +4,12 @@
 #include <linux/usb.h>  // Needed for usb
 #include <linux/proc_fs.h> // Proc file stuff
 #include <linux/seq_file.h>
+#include <linux/pm_runtime.h> // Runtime power management
+#include <linux/workqueue.h> // Delayed work for pre-wake hold
+#include <linux/ktime.h> // Resume latency timing
+#include <linux/mutex.h> // Guards the telemetry history
+#include <linux/slab.h> // DMA safe buffer for the status probe
+#include <linux/io_uring/cmd.h> // io_uring passthrough commands
 
 
 // The license type
@@ -17,8 +23,34 @@ MODULE_VERSION("1.0");
 #define BUF_SIZE 512
 
 #define MAGIC_NUM 0x80
+
+// Vendor control request the arm takes its 3 command bytes on
+#define ARM_CMD_REQUEST_TYPE 0x40
+#define ARM_CMD_REQUEST 6
+#define ARM_CMD_VALUE 0x100
 #define IOCTL_SET_VALUE _IOW(MAGIC_NUM, 1, struct device_command)
 #define IOCTL_GET_VALUE _IOR(MAGIC_NUM, 2, struct device_command)
+#define IOCTL_PREWAKE _IOW(MAGIC_NUM, 3, int)
+#define IOCTL_GET_PM_STATS _IOR(MAGIC_NUM, 4, struct device_pm_stats)
+#define IOCTL_GET_TELEMETRY _IOR(MAGIC_NUM, 5, struct device_telemetry)
+
+// io_uring passthrough (IORING_OP_URING_CMD) ops, the payload sits inline in the SQE cmd area
+#define URING_CMD_SET_STATE _IOW(MAGIC_NUM, 6, struct device_command)
+#define URING_CMD_GET_STATUS _IO(MAGIC_NUM, 7)
+// Same limit send_cmd() gives usb_control_msg()
+#define URING_CMD_TIMEOUT_MS 1000
+// Most SET_STATEs queued or in flight at once, each one holds the arm awake
+#define URING_SET_QUEUE_MAX 32
+
+// Default idle time before the arm is allowed to autosuspend
+#define DEFAULT_AUTOSUSPEND_MS 2000
+// Upper bound on how long a pre-wake hint can keep the arm awake
+#define MAX_PREWAKE_MS 60000
+
+// Telemetry history size and the sliding windows computed over it (in samples)
+#define TELEMETRY_HISTORY 64
+#define TELEMETRY_WINDOWS 3
+static const int telemetry_window_sizes[TELEMETRY_WINDOWS] = {4, 16, TELEMETRY_HISTORY};
 
 // global storage for device Major number
 static int major = 0;
@@ -31,7 +63,7 @@ static int claw_status = 0;
 
 static int connection_status = 0;
 static int command_status = 0;
-static int battery_level = 0;
+static int link_rtt_us = 0; // Round trip of the last good telemetry probe
 
 // Text for nice print
 const char *connection_status_text;
@@ -40,11 +72,49 @@ const char *command_status_text;
 // Command for arm
 static int command[3] = {0, 0, 0};
 
+// Guards command[] and the joint statuses, io_uring completions update them from interrupt context
+static DEFINE_SPINLOCK(command_lock);
+
 // Buffer for character device IO
 static char command_buffer[BUF_SIZE];
 
 // Structure to hold the active USB device reference
 static struct usb_device *active_usb_device = NULL;
+// Interface is needed as well since runtime PM references are taken on it
+static struct usb_interface *active_usb_interface = NULL;
+
+// Idle period before autosuspend, can be set on insmod (applied on probe)
+static int autosuspend_delay_ms = DEFAULT_AUTOSUSPEND_MS;
+// Read only since it is copied to the device on probe, change power/autosuspend_delay_ms on the device after that
+module_param(autosuspend_delay_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_delay_ms, "Idle time in ms before the arm autosuspends (-1 disables), applied on probe");
+
+// Power management bookkeeping
+static ktime_t wake_request_time = 0; // Set when a wake was requested while suspended
+static s64 last_resume_latency_us = 0;
+static s64 max_resume_latency_us = 0;
+static unsigned int resume_count = 0;
+static unsigned int suspend_count = 0;
+
+// Releases the reference taken by a pre-wake hint once the hold time ends
+static void prewake_release(struct work_struct *work);
+static DECLARE_DELAYED_WORK(prewake_work, prewake_release);
+
+// Sampling period for link telemetry, 0 turns the sampler off
+static int telemetry_interval_ms = 1000;
+module_param(telemetry_interval_ms, int, 0644);
+MODULE_PARM_DESC(telemetry_interval_ms, "Link telemetry sampling period in ms (0 disables)");
+
+// Sampler stops by itself once no command has been sent for this long
+static int telemetry_idle_ms = 30000;
+module_param(telemetry_idle_ms, int, 0644);
+MODULE_PARM_DESC(telemetry_idle_ms, "Stop link telemetry after this much idle time in ms");
+
+static unsigned long last_activity = 0; // jiffies of the last command or wake
+
+// Takes one link health sample and re-arms itself while the arm is in use
+static void telemetry_sample(struct work_struct *work);
+static DECLARE_DELAYED_WORK(telemetry_work, telemetry_sample);
 
 // Table of USB id's (There can be 2 versions so we account for that)
 static struct usb_device_id usb_ids[] = {
@@ -64,6 +134,73 @@ struct device_command {
     int var3;
 };
 
+// Power management stats returned by IOCTL_GET_PM_STATS (latencies in microseconds)
+struct device_pm_stats {
+    __s64 last_resume_latency_us;
+    __s64 max_resume_latency_us;
+    __u32 resume_count;
+    __u32 suspend_count;
+    __s32 suspended;
+    __s32 autosuspend_delay_ms;
+};
+
+// One link health probe, rtt_us is only valid when status >= 0
+struct telemetry_sample {
+    __s64 timestamp_ns; // Wall clock time of the probe
+    __u32 rtt_us;
+    __s32 status; // Return of the control transfer
+};
+
+// Stats over the most recent `size` samples
+struct telemetry_window {
+    __u32 size;
+    __u32 samples;
+    __u32 errors;
+    __u32 min_rtt_us;
+    __u32 avg_rtt_us;
+    __u32 max_rtt_us;
+};
+
+// Everything IOCTL_GET_TELEMETRY hands back, history[head] is the next slot to be written
+struct device_telemetry {
+    __s64 last_success_ns;
+    __u64 total_samples;
+    __u64 total_errors;
+    __u32 head;
+    __u32 count;
+    struct telemetry_window windows[TELEMETRY_WINDOWS];
+    struct telemetry_sample history[TELEMETRY_HISTORY];
+};
+
+// Tracks one in flight io_uring command until its USB transfer finishes
+struct uring_request {
+    struct list_head node; // Position in the SET_STATE queue
+    struct io_uring_cmd *ioucmd;
+    struct usb_interface *interface; // Holds a runtime PM reference until completion
+    struct urb *urb;
+    struct usb_ctrlrequest *setup;
+    unsigned char *data;
+    struct device_command state; // What a SET_STATE sends, applied to command[] once the arm has it
+    struct delayed_work timeout; // Kills the URB if the arm never answers
+    int is_set;
+    int resumed; // PM reference came from a real resume rather than a no-resume get
+    int timed_out;
+    int result;
+};
+
+// In flight io_uring transfers so they can be cancelled on disconnect
+static struct usb_anchor uring_anchor;
+
+// SET_STATE transfers go out one at a time so they reach the arm in submission order
+static LIST_HEAD(uring_set_queue);
+static DEFINE_SPINLOCK(uring_set_lock);
+static int uring_set_busy = 0;
+static int uring_set_depth = 0; // Queued plus in flight, capped at URING_SET_QUEUE_MAX
+
+// Telemetry state, windows are recomputed on every sample so readers just copy it
+static struct device_telemetry telemetry;
+static DEFINE_MUTEX(telemetry_lock);
+
 // Helper to quicly modify the whole command
 static void modify_command(const int a, const int b, const int c) {
     command[0] = a;
@@ -75,58 +212,222 @@ static void modify_command(const int a, const int b, const int c) {
 static int usb_probe(struct usb_interface *interface, const struct usb_device_id *id) {
     printk(KERN_INFO "%s: USB device found: Vendor: 0x%04x, Product ID: 0x%04x\n", KBUILD_MODNAME, id->idVendor, id->idProduct);
     active_usb_device = interface_to_usbdev(interface);
+    active_usb_interface = interface;
     connection_status = 1;
+
+    // Start a fresh history so trends are per arm after a replug or swap
+    mutex_lock(&telemetry_lock);
+    memset(&telemetry, 0, sizeof(telemetry));
+    mutex_unlock(&telemetry_lock);
+    link_rtt_us = 0;
+
+    // Undo the poisoning from a previous disconnect
+    usb_unpoison_anchored_urbs(&uring_anchor);
+
+    // Let the arm (and the hub above it) drop power after sitting idle
+    pm_runtime_set_autosuspend_delay(&active_usb_device->dev, autosuspend_delay_ms);
+    usb_enable_autosuspend(active_usb_device);
+
     return 0;
 }
 
 // Handles usb disconnections
 static void usb_disconnect(struct usb_interface *interface) {
+
+    unsigned long flags;
+
     printk(KERN_INFO "%s: USB device removed\n", KBUILD_MODNAME);
+
+    cancel_delayed_work_sync(&telemetry_work);
+
+    // Fails any io_uring transfers still in flight, their CQEs get -ENOENT
+    // Poisoning also fails the queued SET_STATEs as the queue tries to submit them
+    usb_poison_anchored_urbs(&uring_anchor);
+
+    // Drop any reference still held by a pre-wake hint
+    if (cancel_delayed_work_sync(&prewake_work)) {
+        usb_autopm_put_interface_no_suspend(interface);
+    }
+
     active_usb_device = NULL;
+    active_usb_interface = NULL;
     connection_status = 0;
+    wake_request_time = 0;
 
     // Since device has been disconnected we can reset all values
+    spin_lock_irqsave(&command_lock, flags);
     modify_command(0, 0, 0);
     shoulder_status = 0;
     elbow_status = 0;
     wrist_status = 0;
     claw_status = 0;
+    spin_unlock_irqrestore(&command_lock, flags);
 }
 
-// Struct for USB has to be bellow functions, or it breaks ?
-static struct usb_driver usb_driver = {
-    .name = "A37JN Robot arm",
-    .id_table = usb_ids,
-    .probe = usb_probe,
-    .disconnect = usb_disconnect
-};
+// Remember when a wake was asked for so resume latency can be measured
+// The interface reads as suspended whenever nobody holds it, the device is what actually sleeps
+static void note_wake_request(void) {
+    if (active_usb_device && pm_runtime_suspended(&active_usb_device->dev) && !wake_request_time) {
+        wake_request_time = ktime_get();
+    }
+}
 
+// Whether the arm itself is powered down right now
+static int arm_suspended(void) {
+    return active_usb_device ? pm_runtime_suspended(&active_usb_device->dev) : 0;
+}
 
-// Function to send a command to the robot arm
-static int send_cmd(void) {
+// Recompute min, avg and max for every window, newest sample first
+static void telemetry_update_windows(void) {
 
-    // Sanity Check that USB device exists
-    if (!active_usb_device) {
-        printk(KERN_ERR "%s: No active USB device\n", KBUILD_MODNAME);
-        connection_status = 0;
-        return -ENODEV;
+    for (int w = 0; w < TELEMETRY_WINDOWS; w++) {
+
+        struct telemetry_window *window = &telemetry.windows[w];
+        u64 sum = 0;
+        int n = min_t(int, telemetry_window_sizes[w], telemetry.count);
+
+        window->size = telemetry_window_sizes[w];
+        window->samples = n;
+        window->errors = 0;
+        window->min_rtt_us = U32_MAX;
+        window->max_rtt_us = 0;
+
+        for (int i = 1; i <= n; i++) {
+            const struct telemetry_sample *sample = &telemetry.history[(telemetry.head + TELEMETRY_HISTORY - i) % TELEMETRY_HISTORY];
+
+            if (sample->status < 0) {
+                window->errors++;
+                continue;
+            }
+
+            sum += sample->rtt_us;
+            window->min_rtt_us = min(window->min_rtt_us, sample->rtt_us);
+            window->max_rtt_us = max(window->max_rtt_us, sample->rtt_us);
+        }
+
+        if (n > window->errors) {
+            window->avg_rtt_us = (__u32) div_u64(sum, n - window->errors);
+        } else {
+            // Nothing succeeded so there is no rtt to report
+            window->min_rtt_us = 0;
+            window->avg_rtt_us = 0;
+        }
+    }
+}
+
+static void telemetry_record(const __u32 rtt_us, const int status) {
+
+    mutex_lock(&telemetry_lock);
+
+    struct telemetry_sample *sample = &telemetry.history[telemetry.head];
+
+    sample->timestamp_ns = ktime_get_real_ns();
+    sample->rtt_us = status < 0 ? 0 : rtt_us;
+    sample->status = status;
+
+    telemetry.head = (telemetry.head + 1) % TELEMETRY_HISTORY;
+    if (telemetry.count < TELEMETRY_HISTORY) {
+        telemetry.count++;
+    }
+
+    telemetry.total_samples++;
+    if (status < 0) {
+        telemetry.total_errors++;
+    } else {
+        telemetry.last_success_ns = sample->timestamp_ns;
+    }
+
+    telemetry_update_windows();
+
+    mutex_unlock(&telemetry_lock);
+}
+
+// Start the sampler if it is not already running
+static void telemetry_kick(void) {
+    last_activity = jiffies;
+    if (telemetry_interval_ms > 0) {
+        queue_delayed_work(system_wq, &telemetry_work, msecs_to_jiffies(telemetry_interval_ms));
     }
+}
+
+static void telemetry_sample(struct work_struct *work) {
+
+    struct usb_interface *interface = active_usb_interface;
+
+    if (!interface || telemetry_interval_ms <= 0) {
+        return;
+    }
+
+    // Arm has been idle for a while, stop until the next command
+    if (time_after(jiffies, last_activity + msecs_to_jiffies(telemetry_idle_ms))) {
+        return;
+    }
+
+    struct usb_device *usb_device = interface_to_usbdev(interface);
+
+    // Only sample while the arm is awake, waking it up just to probe would defeat autosuspend
+    // The interface reads as suspended whenever nobody holds it, so look at the device instead
+    // Holding the interface reference keeps the device from suspending under us
+    usb_autopm_get_interface_no_resume(interface);
+    if (!pm_runtime_active(&usb_device->dev)) {
+        usb_autopm_put_interface_no_suspend(interface);
+        return;
+    }
+
+    // GET_STATUS is a harmless round trip that every device has to answer
+    __le16 *status_buffer = kmalloc(sizeof(*status_buffer), GFP_KERNEL);
+    if (status_buffer) {
+
+        const ktime_t start = ktime_get();
+        int ret = usb_control_msg(usb_device,
+            usb_rcvctrlpipe(usb_device, 0),
+            USB_REQ_GET_STATUS,
+            USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE,
+            0, 0,
+            status_buffer, sizeof(*status_buffer),
+            500);
+        const __u32 rtt_us = (__u32) ktime_us_delta(ktime_get(), start);
+
+        kfree(status_buffer);
+
+        // Only recorded, connection and command status belong to the command paths
+        telemetry_record(rtt_us, ret);
+
+        if (ret >= 0) {
+            link_rtt_us = rtt_us;
+        }
+    }
+
+    // Sampling does not count as activity so no usb_mark_last_busy here,
+    // but an autosuspend attempt refused while we held the reference has to be retried
+    usb_autopm_put_interface_no_suspend(interface);
+    pm_request_autosuspend(&usb_device->dev);
+
+    queue_delayed_work(system_wq, &telemetry_work, msecs_to_jiffies(telemetry_interval_ms));
+}
+
+// Pushes the current command to the arm, caller must make sure the device is awake
+static int transfer_cmd(void) {
 
     unsigned char parsed_command[3];
+    unsigned long flags;
 
     // convert list of ints to unsigned char
     // apparently this is the easiest way to do so ?
     // something about the length of the int being unknown (up to four)
+    // Snapshot under the lock since the send below sleeps
+    spin_lock_irqsave(&command_lock, flags);
     for (int i = 0; i < 3; i++) {
         parsed_command[i] = (unsigned char)command[i];
     }
+    spin_unlock_irqrestore(&command_lock, flags);
 
     int ret;
 
     // Makes sure we use linux kernel definition of u8, u16 (Good practice)
-    const __u8 bmRequestType = 0x40;
-    const __u8 bRequest = 6;
-    const __u16 wValue = 0x100;
+    const __u8 bmRequestType = ARM_CMD_REQUEST_TYPE;
+    const __u8 bRequest = ARM_CMD_REQUEST;
+    const __u16 wValue = ARM_CMD_VALUE;
     const __u16 wIndex = 0;
 
     // Send control message to usb
@@ -140,17 +441,150 @@ static int send_cmd(void) {
 
     if (ret < 0) {
         printk(KERN_INFO "%s: USB control message failed with code: %d\n", KBUILD_MODNAME, ret);
-        battery_level = 0;
         connection_status = 0;
     } else {
         printk(KERN_INFO "%s: Sent command to USB device: [%d, %d, %d] Return: %d \n", KBUILD_MODNAME, parsed_command[0], parsed_command[1], parsed_command[2], ret);
-        battery_level = ret;
         connection_status = 1;
     }
 
     return ret;
 }
 
+// Function to send a command to the robot arm
+static int send_cmd(void) {
+
+    // Sanity Check that USB device exists
+    if (!active_usb_device) {
+        printk(KERN_ERR "%s: No active USB device\n", KBUILD_MODNAME);
+        connection_status = 0;
+        return -ENODEV;
+    }
+
+    int ret;
+
+    // Wake the arm up if it autosuspended (no-op if already awake)
+    note_wake_request();
+    ret = usb_autopm_get_interface(active_usb_interface);
+
+    // Any resume has already taken its measurement, drop the stamp if none ran
+    wake_request_time = 0;
+
+    if (ret < 0) {
+        printk(KERN_ERR "%s: Failed to resume USB device: %d\n", KBUILD_MODNAME, ret);
+        return ret;
+    }
+
+    ret = transfer_cmd();
+
+    // Restart the idle timer from this command
+    usb_mark_last_busy(active_usb_device);
+    usb_autopm_put_interface(active_usb_interface);
+    telemetry_kick();
+
+    return ret;
+}
+
+// Called by the USB core before the arm is powered down
+static int usb_suspend(struct usb_interface *interface, pm_message_t message) {
+
+    unsigned long flags;
+
+    // Never autosuspend while a motor or the LED is commanded on, the arm would just stop
+    spin_lock_irqsave(&command_lock, flags);
+    const int outputs_on = command[0] || command[1] || command[2];
+    spin_unlock_irqrestore(&command_lock, flags);
+
+    if (PMSG_IS_AUTO(message) && outputs_on) {
+        return -EBUSY;
+    }
+
+    suspend_count++;
+    printk(KERN_INFO "%s: Suspending\n", KBUILD_MODNAME);
+    return 0;
+}
+
+// Called by the USB core once the arm is powered again
+static int usb_resume(struct usb_interface *interface) {
+
+    unsigned long flags;
+
+    resume_count++;
+
+    spin_lock_irqsave(&command_lock, flags);
+    const int outputs_on = command[0] || command[1] || command[2];
+    spin_unlock_irqrestore(&command_lock, flags);
+
+    // The arm forgets its outputs while unpowered so restore the commanded state
+    if (outputs_on) {
+        transfer_cmd();
+    }
+
+    // Work out how long the caller had to wait for the arm to come back (including the restore)
+    if (wake_request_time) {
+        last_resume_latency_us = ktime_us_delta(ktime_get(), wake_request_time);
+        if (last_resume_latency_us > max_resume_latency_us) {
+            max_resume_latency_us = last_resume_latency_us;
+        }
+        wake_request_time = 0;
+    }
+
+    // Sample the link again now that the arm is awake
+    telemetry_kick();
+
+    printk(KERN_INFO "%s: Resumed (latency: %lld us)\n", KBUILD_MODNAME, last_resume_latency_us);
+    return 0;
+}
+
+// Struct for USB has to be bellow functions, or it breaks ?
+static struct usb_driver usb_driver = {
+    .name = "A37JN Robot arm",
+    .id_table = usb_ids,
+    .probe = usb_probe,
+    .disconnect = usb_disconnect,
+    .suspend = usb_suspend,
+    .resume = usb_resume,
+    .reset_resume = usb_resume,
+    .supports_autosuspend = 1
+};
+
+// Pre-wake hold has expired, let the arm autosuspend again
+static void prewake_release(struct work_struct *work) {
+    if (active_usb_interface) {
+        usb_mark_last_busy(active_usb_device);
+        usb_autopm_put_interface_async(active_usb_interface);
+    }
+}
+
+// Start resuming the arm ahead of a planned move and keep it awake for hold_ms
+static int prewake(int hold_ms) {
+
+    if (!active_usb_interface) {
+        return -ENODEV;
+    }
+
+    if (hold_ms <= 0 || hold_ms > MAX_PREWAKE_MS) {
+        return -EINVAL;
+    }
+
+    // Async so the caller can carry on planning while the arm wakes up
+    note_wake_request();
+    const int ret = usb_autopm_get_interface_async(active_usb_interface);
+    if (ret < 0) {
+        wake_request_time = 0;
+        return ret;
+    }
+
+    // If a hold is already pending it keeps its reference, just extend it and drop ours
+    if (mod_delayed_work(system_wq, &prewake_work, msecs_to_jiffies(hold_ms))) {
+        usb_autopm_put_interface_async(active_usb_interface);
+    }
+
+    // A planned move counts as activity for the sampler
+    telemetry_kick();
+
+    return 0;
+}
+
 // Detects device open event
 static int device_open(struct inode *inode_pointer, struct file *file_pointer) {
     printk(KERN_INFO "%s: Device opened\n", KBUILD_MODNAME);
@@ -172,7 +606,7 @@ static void update_status_text(void) {
         // Assume we are not connected
         connection_status_text = "no";
         command_status = 0;
-        battery_level = 0;
+        link_rtt_us = 0;
     }
 
     if (command_status == 1) {
@@ -188,14 +622,14 @@ static void update_status_text(void) {
 // Handles userspace reading from character device
 static ssize_t device_read(struct file *file_pointer, char __user *buffer, size_t len, loff_t *offset) {
 
-    char status_message[64];
+    char status_message[80];
     int msg_length;
 
     // Update status text
     update_status_text();
 
     // Format the message
-    msg_length = snprintf(status_message, sizeof(status_message), "connected:%s status:%s battery:%d\n", connection_status_text, command_status_text, battery_level);
+    msg_length = snprintf(status_message, sizeof(status_message), "connected:%s status:%s link_rtt_us:%d\n", connection_status_text, command_status_text, link_rtt_us);
 
     // Handle the offset (ensures the message is only read once per call)
     if (*offset >= msg_length) {
@@ -453,13 +887,16 @@ static ssize_t device_write(struct file *file_pointer, const char *buffer, const
     // Loop through the buffer to process all commands
     char *cmd_start = command_buffer;
     char *cmd_end;
+    unsigned long flags;
 
     while ((cmd_end = strchr(cmd_start, '\n')) != NULL) {
 
         printk(KERN_INFO "%s: Processing: %s", KBUILD_MODNAME, cmd_start);
 
         *cmd_end = '\0'; // Null terminate the current command
+        spin_lock_irqsave(&command_lock, flags);
         process_command(cmd_start); // Process the command
+        spin_unlock_irqrestore(&command_lock, flags);
 
         // Move cmd_start to the next command after the newline
         cmd_start = cmd_end + 1;
@@ -467,7 +904,9 @@ static ssize_t device_write(struct file *file_pointer, const char *buffer, const
 
     // If there's any leftover data (no newline at the end), handle it as the last command
     if (*cmd_start != '\0') {
+        spin_lock_irqsave(&command_lock, flags);
         process_command(cmd_start);
+        spin_unlock_irqrestore(&command_lock, flags);
     }
 
     // Send processed command to robot arm
@@ -480,10 +919,84 @@ static ssize_t device_write(struct file *file_pointer, const char *buffer, const
     return len;
 }
 
+// Checks a raw 3 value command is something the arm understands
+static int check_direct_command(const struct device_command *command) {
+
+    // A bit messy but it works :/
+    if (command->var1 < 0 || command->var2 < 0 || command->var3 < 0 ||
+        command->var1 > 170 || command->var2 > 2 || command->var3 > 1) {
+        command_status = 2;
+        return -EINVAL; // Reject invalid values
+    }
+
+    return 0;
+}
+
+// Validates a raw 3 value command, applies it and keeps the joint statuses in sync
+static int set_direct_command(struct device_command command) {
+
+    unsigned long flags;
+
+    const int ret = check_direct_command(&command);
+    if (ret < 0) {
+        return ret;
+    }
+
+    printk(KERN_INFO "%s: Direct control values: %d,%d,%d\n", KBUILD_MODNAME, command.var1, command.var2, command.var3);
+
+    // Also called from io_uring completions so the whole update goes under the lock
+    spin_lock_irqsave(&command_lock, flags);
+
+    modify_command(command.var1, command.var2, command.var3);
+
+    // We need to set all the statuses so we remain in sync
+    if (command.var1 >= 128) {
+        shoulder_status = 2;
+        command.var1 -= 128;
+    } else if (command.var1 >= 64) {
+        shoulder_status = 1;
+        command.var1 -= 64;
+    } else {
+        shoulder_status = 0;
+    }
+
+    if (command.var1 >= 32) {
+        elbow_status = 2;
+        command.var1 -= 32;
+    } else if (command.var1 >= 16) {
+        elbow_status = 1;
+        command.var1 -= 16;
+    } else {
+        elbow_status = 0;
+    }
+
+    if (command.var1 >= 8) {
+        wrist_status = 2;
+        command.var1 -= 8;
+    } else if (command.var1 >= 4) {
+        wrist_status = 1;
+        command.var1 -= 4;
+    } else {
+        wrist_status = 0;
+    }
+
+    if (command.var1 >= 2) {
+        claw_status = 1;
+    } else if (command.var1 >= 1) {
+        claw_status = 2;
+    } else {
+        claw_status = 0;
+    }
+
+    command_status = 1;
+    spin_unlock_irqrestore(&command_lock, flags);
+
+    return 0;
+}
+
 static long device_ioctl(struct file *file, const unsigned int cmd, const unsigned long arg) {
 
     struct device_command command;
-    static int temp_command[3] = {0,0,0};
 
     if (cmd == IOCTL_SET_VALUE) {
             
@@ -492,75 +1005,377 @@ static long device_ioctl(struct file *file, const unsigned int cmd, const unsign
             return -EFAULT;
         }
 
-        // A bit messy but it works :/
-        if (command.var1 < 0 || command.var2 < 0 || command.var3 < 0 ||
-            command.var1 > 170 || command.var2 > 2 || command.var3 > 1) {
-            command_status = 2;
-            return -EINVAL; // Reject invalid values
+        const int ret = set_direct_command(command);
+        if (ret < 0) {
+            return ret;
         }
 
-        printk(KERN_INFO "%s: Direct control values: %d,%d,%d\n", KBUILD_MODNAME, command.var1, command.var2, command.var3);
+    } else if (cmd == IOCTL_PREWAKE) {
 
-        temp_command[0] = command.var1;
-        temp_command[1] = command.var2;
-        temp_command[2] = command.var3;
+        int hold_ms;
 
-        // We need to set all the statuses so we remain in sync
-        if (command.var1 >= 128) {
-            shoulder_status = 2;
-            command.var1 -= 128;
-        } else if (command.var1 >= 64) {
-            shoulder_status = 1;
-            command.var1 -= 64;
-        } else {
-            shoulder_status = 0;
+        if (copy_from_user(&hold_ms, (int __user *)arg, sizeof(int))) {
+            return -EFAULT;
         }
 
-        if (command.var1 >= 32) {
-            elbow_status = 2;
-            command.var1 -= 32;
-        } else if (command.var1 >= 16) {
-            elbow_status = 1;
-            command.var1 -= 16;
-        } else {
-            elbow_status = 0;
-        }
+        // Only a hint, nothing gets sent to the arm
+        return prewake(hold_ms);
 
-        if (command.var1 >= 8) {
-            wrist_status = 2;
-            command.var1 -= 8;
-        } else if (command.var1 >= 4) {
-            wrist_status = 1;
-            command.var1 -= 4;
-        } else {
-            wrist_status = 0;
+    } else if (cmd == IOCTL_GET_PM_STATS) {
+
+        struct device_pm_stats stats;
+
+        memset(&stats, 0, sizeof(stats));
+        stats.last_resume_latency_us = last_resume_latency_us;
+        stats.max_resume_latency_us = max_resume_latency_us;
+        stats.resume_count = resume_count;
+        stats.suspend_count = suspend_count;
+        stats.suspended = arm_suspended();
+        stats.autosuspend_delay_ms = active_usb_device ? active_usb_device->dev.power.autosuspend_delay : autosuspend_delay_ms;
+
+        if (copy_to_user((struct device_pm_stats __user *)arg, &stats, sizeof(stats))) {
+            return -EFAULT;
         }
 
-        if (command.var1 >= 2) {
-            claw_status = 1;
-        } else if (command.var1 >= 1) {
-            claw_status = 2;
-        } else {
-            claw_status = 0;
+        return 0;
+
+    } else if (cmd == IOCTL_GET_TELEMETRY) {
+
+        // Too big for the stack so copy straight out of the shared state
+        mutex_lock(&telemetry_lock);
+        const unsigned long not_copied = copy_to_user((struct device_telemetry __user *)arg, &telemetry, sizeof(telemetry));
+        mutex_unlock(&telemetry_lock);
+
+        if (not_copied) {
+            return -EFAULT;
         }
 
+        return 0;
+
     } else {
         return -EINVAL;  // Invalid command
     }
 
 
-    // Execute the command
-    modify_command(temp_command[0], temp_command[1], temp_command[2]);
-    command_status = 1;
-
     // Send command to robot arm
     send_cmd();
 
     return 0;
 }
 
+static void uring_request_free(struct uring_request *request) {
+    usb_free_urb(request->urb);
+    kfree(request->data);
+    kfree(request->setup);
+    kfree(request);
+}
+
+// Drops the PM reference an io_uring request took, callable from interrupt context
+static void uring_put_pm(struct usb_interface *interface, const int resumed) {
+
+    struct usb_device *usb_device = interface_to_usbdev(interface);
+
+    usb_mark_last_busy(usb_device);
+
+    if (resumed) {
+        usb_autopm_put_interface_async(interface);
+    } else {
+        // A no-resume reference never woke the interface so idle has to be requested on the device
+        usb_autopm_put_interface_no_suspend(interface);
+        pm_request_autosuspend(&usb_device->dev);
+    }
+}
+
+// Runs in task context, posts the CQE for a finished transfer
+static void uring_cmd_finish(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+    struct uring_request *request = *(struct uring_request **)ioucmd->pdu;
+    const int result = request->result;
+
+    // Timeout work may still be looking at the URB
+    cancel_delayed_work_sync(&request->timeout);
+
+    uring_request_free(request);
+    io_uring_cmd_done(ioucmd, result, 0, issue_flags);
+}
+
+// Hands a request back to io_uring, the request must not be touched after this
+// Reserves a spot in the SET_STATE queue, -EBUSY once it is full
+static int uring_set_reserve(void) {
+
+    unsigned long flags;
+    int ret = 0;
+
+    spin_lock_irqsave(&uring_set_lock, flags);
+    if (uring_set_depth >= URING_SET_QUEUE_MAX) {
+        ret = -EBUSY;
+    } else {
+        uring_set_depth++;
+    }
+    spin_unlock_irqrestore(&uring_set_lock, flags);
+
+    return ret;
+}
+
+static void uring_set_release(void) {
+
+    unsigned long flags;
+
+    spin_lock_irqsave(&uring_set_lock, flags);
+    uring_set_depth--;
+    spin_unlock_irqrestore(&uring_set_lock, flags);
+}
+
+static void uring_request_complete(struct uring_request *request, const int result) {
+    if (request->is_set) {
+        uring_set_release();
+    }
+    request->result = result;
+    uring_put_pm(request->interface, request->resumed);
+    io_uring_cmd_complete_in_task(request->ioucmd, uring_cmd_finish);
+}
+
+// Arm never answered, killing the URB completes it with -ENOENT
+static void uring_timeout(struct work_struct *work) {
+    struct uring_request *request = container_of(to_delayed_work(work), struct uring_request, timeout);
+
+    request->timed_out = 1;
+    usb_kill_urb(request->urb);
+}
+
+static int uring_start_request(struct uring_request *request, const gfp_t mem_flags) {
+
+    // Armed first so a fast completion always finds it to cancel
+    schedule_delayed_work(&request->timeout, msecs_to_jiffies(URING_CMD_TIMEOUT_MS));
+
+    usb_anchor_urb(request->urb, &uring_anchor);
+    const int ret = usb_submit_urb(request->urb, mem_flags);
+    if (ret < 0) {
+        usb_unanchor_urb(request->urb);
+    }
+
+    return ret;
+}
+
+// Submits the next queued SET_STATE if none is in flight
+static void uring_set_queue_kick(const gfp_t mem_flags) {
+
+    struct uring_request *request;
+    unsigned long flags;
+
+    for (;;) {
+        spin_lock_irqsave(&uring_set_lock, flags);
+        if (uring_set_busy || list_empty(&uring_set_queue)) {
+            spin_unlock_irqrestore(&uring_set_lock, flags);
+            return;
+        }
+        request = list_first_entry(&uring_set_queue, struct uring_request, node);
+        list_del(&request->node);
+        uring_set_busy = 1;
+        spin_unlock_irqrestore(&uring_set_lock, flags);
+
+        const int ret = uring_start_request(request, mem_flags);
+        if (ret == 0) {
+            return;
+        }
+
+        // Could not even submit this one, fail it and move on to the next
+        uring_request_complete(request, ret);
+
+        spin_lock_irqsave(&uring_set_lock, flags);
+        uring_set_busy = 0;
+        spin_unlock_irqrestore(&uring_set_lock, flags);
+    }
+}
+
+// URB completion, runs in interrupt context so only bookkeeping happens here
+static void uring_urb_complete(struct urb *urb) {
+
+    struct uring_request *request = urb->context;
+    const int is_set = request->is_set;
+    int result;
+
+    if (urb->status < 0) {
+        result = request->timed_out ? -ETIMEDOUT : urb->status;
+        connection_status = 0;
+    } else if (is_set) {
+        // SET_STATEs finish in order so the cached state always matches what the arm last got
+        set_direct_command(request->state);
+        result = urb->actual_length;
+        connection_status = 1;
+    } else {
+        unsigned long flags;
+
+        // Status query answers with the commanded bytes packed as base | movement << 8 | led << 16
+        spin_lock_irqsave(&command_lock, flags);
+        result = command[0] | command[1] << 8 | command[2] << 16;
+        spin_unlock_irqrestore(&command_lock, flags);
+        connection_status = 1;
+    }
+
+    uring_request_complete(request, result);
+
+    if (is_set) {
+        unsigned long flags;
+
+        spin_lock_irqsave(&uring_set_lock, flags);
+        uring_set_busy = 0;
+        spin_unlock_irqrestore(&uring_set_lock, flags);
+
+        uring_set_queue_kick(GFP_ATOMIC);
+    }
+}
+
+// Queues a control transfer for an io_uring command (state NULL means status query)
+// completion is posted from uring_urb_complete
+static int uring_submit(struct io_uring_cmd *ioucmd, const struct device_command *state, const unsigned int issue_flags) {
+
+    struct usb_interface *interface = active_usb_interface;
+    struct usb_device *usb_device;
+    int resumed;
+    int ret;
+
+    if (!interface) {
+        return -ENODEV;
+    }
+
+    usb_device = interface_to_usbdev(interface);
+
+    // Cap the queue before taking anything, every queued SET_STATE keeps the arm awake
+    if (state) {
+        ret = uring_set_reserve();
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    // Waking the arm blocks, so in a nonblocking issue hand it back to io_uring to retry from a worker
+    // The interface reads as suspended whenever nobody holds it, the device is what actually sleeps
+    if (issue_flags & IO_URING_F_NONBLOCK) {
+        usb_autopm_get_interface_no_resume(interface);
+        if (!pm_runtime_active(&usb_device->dev)) {
+            usb_autopm_put_interface_no_suspend(interface);
+            ret = -EAGAIN;
+            goto release_slot;
+        }
+        resumed = 0;
+    } else {
+        note_wake_request();
+        ret = usb_autopm_get_interface(interface);
+
+        // Any resume has already taken its measurement, drop the stamp if none ran
+        wake_request_time = 0;
+
+        if (ret < 0) {
+            goto release_slot;
+        }
+        resumed = 1;
+    }
+
+    struct uring_request *request = kzalloc(sizeof(*request), GFP_KERNEL);
+    if (!request) {
+        ret = -ENOMEM;
+        goto put_pm;
+    }
+
+    request->ioucmd = ioucmd;
+    request->interface = interface;
+    request->resumed = resumed;
+    INIT_DELAYED_WORK(&request->timeout, uring_timeout);
+    request->urb = usb_alloc_urb(0, GFP_KERNEL);
+    request->setup = kzalloc(sizeof(*request->setup), GFP_KERNEL);
+    request->data = kzalloc(3, GFP_KERNEL);
+    if (!request->urb || !request->setup || !request->data) {
+        ret = -ENOMEM;
+        goto free_request;
+    }
+
+    if (!state) {
+        // Same harmless GET_STATUS round trip the telemetry sampler uses
+        request->setup->bRequestType = USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE;
+        request->setup->bRequest = USB_REQ_GET_STATUS;
+        request->setup->wValue = cpu_to_le16(0);
+        request->setup->wLength = cpu_to_le16(2);
+    } else {
+        // Same request send_cmd() uses
+        request->is_set = 1;
+        request->state = *state;
+        request->data[0] = (unsigned char)state->var1;
+        request->data[1] = (unsigned char)state->var2;
+        request->data[2] = (unsigned char)state->var3;
+        request->setup->bRequestType = ARM_CMD_REQUEST_TYPE;
+        request->setup->bRequest = ARM_CMD_REQUEST;
+        request->setup->wValue = cpu_to_le16(ARM_CMD_VALUE);
+        request->setup->wLength = cpu_to_le16(3);
+    }
+    request->setup->wIndex = cpu_to_le16(0);
+
+    usb_fill_control_urb(request->urb, usb_device,
+        !state ? usb_rcvctrlpipe(usb_device, 0) : usb_sndctrlpipe(usb_device, 0),
+        (unsigned char *)request->setup,
+        request->data, le16_to_cpu(request->setup->wLength),
+        uring_urb_complete, request);
+
+    *(struct uring_request **)ioucmd->pdu = request;
+
+    if (state) {
+        unsigned long flags;
+
+        spin_lock_irqsave(&uring_set_lock, flags);
+        list_add_tail(&request->node, &uring_set_queue);
+        spin_unlock_irqrestore(&uring_set_lock, flags);
+
+        uring_set_queue_kick(GFP_KERNEL);
+    } else {
+        // Queries do not change anything so they can run alongside the SET_STATE queue
+        ret = uring_start_request(request, GFP_KERNEL);
+        if (ret < 0) {
+            uring_request_complete(request, ret);
+        }
+    }
+
+    telemetry_kick();
+    return -EIOCBQUEUED;
+
+free_request:
+    uring_request_free(request);
+put_pm:
+    uring_put_pm(interface, resumed);
+release_slot:
+    if (state) {
+        uring_set_release();
+    }
+    return ret;
+}
+
+// io_uring passthrough entry point, lets one thread batch commands to the arm without blocking
+static int device_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+
+    struct device_command command;
+
+    if (ioucmd->cmd_op == URING_CMD_SET_STATE) {
+
+        // SQE lives in memory shared with userspace so take a private copy first
+        memcpy(&command, io_uring_sqe_cmd(ioucmd->sqe), sizeof(command));
+
+        // Only validated here, the state is applied once the transfer completes
+        const int ret = check_direct_command(&command);
+        if (ret < 0) {
+            return ret;
+        }
+
+        return uring_submit(ioucmd, &command, issue_flags);
+
+    } else if (ioucmd->cmd_op == URING_CMD_GET_STATUS) {
+        return uring_submit(ioucmd, NULL, issue_flags);
+    }
+
+    return -ENOTTY;  // Invalid command
+}
+
 struct file_operations fops = {
+    .owner = THIS_MODULE, // uring completions run after the syscall returns so the module must stay loaded
     .unlocked_ioctl = device_ioctl,
+    .uring_cmd = device_uring_cmd,
     .read = device_read,
     .write = device_write,
     .open = device_open,
@@ -576,7 +1391,18 @@ static int proc_show(struct seq_file *m, void *v) {
     seq_printf(m, "Elbow Status: %d\n", elbow_status);
     seq_printf(m, "Wrist Status: %d\n", wrist_status);
     seq_printf(m, "Claw Status: %d\n", claw_status);
-    seq_printf(m, "connected:%s status:%s battery:%d\n", connection_status_text, command_status_text, battery_level);
+    seq_printf(m, "connected:%s status:%s link_rtt_us:%d\n", connection_status_text, command_status_text, link_rtt_us);
+    seq_printf(m, "Suspended: %d\n", arm_suspended());
+    seq_printf(m, "Suspends: %u Resumes: %u\n", suspend_count, resume_count);
+    seq_printf(m, "Resume latency: last %lld us max %lld us\n", last_resume_latency_us, max_resume_latency_us);
+
+    mutex_lock(&telemetry_lock);
+    seq_printf(m, "Link samples: %llu errors: %llu last success: %lld ns\n", telemetry.total_samples, telemetry.total_errors, telemetry.last_success_ns);
+    for (int w = 0; w < TELEMETRY_WINDOWS; w++) {
+        const struct telemetry_window *window = &telemetry.windows[w];
+        seq_printf(m, "Link rtt last %u: min %u avg %u max %u us errors %u/%u\n", window->size, window->min_rtt_us, window->avg_rtt_us, window->max_rtt_us, window->errors, window->samples);
+    }
+    mutex_unlock(&telemetry_lock);
 
     return 0;
 }
@@ -605,6 +1431,8 @@ static int __init A37JN_driver_init(void){
     printk(KERN_INFO "%s: Loading A37JN Robot arm driver...\n",KBUILD_MODNAME);
     printk(KERN_INFO "%s: Creating Character Device\n",KBUILD_MODNAME);
 
+    init_usb_anchor(&uring_anchor);
+
     // Register Character Device
     major = register_chrdev(0, MODULE_NAME, &fops);
 
@@ -672,11 +1500,6 @@ static int __init A37JN_driver_init(void){
 
     printk(KERN_INFO "%s: Successfully registered A37JN Robot arm USB Device\n",KBUILD_MODNAME);
 
-    // Testing
-    printk(KERN_INFO "%s: Led ON\n",KBUILD_MODNAME);
-    modify_command(0,0,1); // Array of 3 bytes (example command)
-    send_cmd();
-
     return 0;
 }
 